@@ -26,8 +26,16 @@
  *
  */
 #include "mod_google_tts.h"
+#include <fcntl.h>
 
 static struct {
+    switch_mutex_t          *mutex;
+    switch_hash_t           *cache_stats;
+    switch_thread_t         *prewarm_thread;
+    switch_mutex_t          *sched_mutex;
+    sched_lane_t            sched_lanes[SCHED_LANES_MAX];
+    uint64_t                sched_vtime;
+    char                    *prewarm_log;
     char                    *file_ext;
     char                    *cache_path;
     char                    *tmp_path;
@@ -41,9 +49,23 @@ static struct {
     uint32_t                file_size_max;
     uint32_t                request_timeout;        // seconds
     uint32_t                connect_timeout;        // seconds
+    uint32_t                prewarm_items;
+    uint32_t                prewarm_samplerate;
+    uint32_t                prewarm_mem_max;
+    uint32_t                prewarm_stats_max;
+    uint32_t                prewarm_flush_interval; // seconds
+    uint32_t                prewarm_decay_interval; // seconds
+    uint32_t                cache_stats_size;
+    uint32_t                sched_max_requests;
+    uint32_t                sched_interactive_reserved;
+    uint32_t                sched_running;
+    int                     sched_default_lane;
     uint8_t                 fl_voice_name_as_lang;
     uint8_t                 fl_log_http_error;
     uint8_t                 fl_cache_enabled;
+    uint8_t                 fl_prewarm_enabled;
+    uint8_t                 fl_cache_stats_dirty;
+    uint8_t                 fl_shutdown;
 } globals;
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_google_tts_load);
@@ -249,6 +271,516 @@ out:
     return status;
 }
 
+// ---------------------------------------------------------------------------------------------------------------------------------------------
+// requests scheduler
+// ---------------------------------------------------------------------------------------------------------------------------------------------
+static int sched_lane_eligible(sched_lane_e lane) {
+    if(globals.sched_running >= globals.sched_max_requests) {
+        return SWITCH_FALSE;
+    }
+    if(lane == SCHED_LANE_BULK && globals.sched_lanes[lane].running >= (globals.sched_max_requests - globals.sched_interactive_reserved)) {
+        return SWITCH_FALSE;
+    }
+    return SWITCH_TRUE;
+}
+
+/*
+ * hands the free slots out to the queued requests (weighted fair queuing on the lanes virtual time).
+ * the system virtual time never goes backwards and a lane held on its cap doesn't bank credit,
+ * otherwise it would win all the contested slots afterwards.
+ * must be called with sched_mutex locked.
+ */
+static void sched_dispatch() {
+    sched_lane_t *lane = NULL;
+    sched_waiter_t *waiter = NULL;
+    int i = 0, best = -1;
+
+    while(SWITCH_TRUE) {
+        for(i = 0, best = -1; i < SCHED_LANES_MAX; i++) {
+            if(!globals.sched_lanes[i].head) {
+                continue;
+            }
+            if(!sched_lane_eligible(i)) {
+                if(globals.sched_lanes[i].vtime < globals.sched_vtime) {
+                    globals.sched_lanes[i].vtime = globals.sched_vtime;
+                }
+                continue;
+            }
+            if(best < 0 || globals.sched_lanes[i].vtime < globals.sched_lanes[best].vtime) {
+                best = i;
+            }
+        }
+        if(best < 0) {
+            break;
+        }
+
+        lane = &globals.sched_lanes[best];
+        waiter = lane->head;
+        lane->head = waiter->next;
+        if(!lane->head) { lane->tail = NULL; }
+
+        waiter->fl_granted = SWITCH_TRUE;
+        switch_thread_cond_signal(waiter->cond);
+        lane->running++;
+        globals.sched_running++;
+
+        if(lane->vtime > globals.sched_vtime) {
+            globals.sched_vtime = lane->vtime;
+        }
+        lane->vtime += (SCHED_VTIME_SCALE / lane->weight);
+    }
+}
+
+static switch_status_t sched_acquire(sched_lane_e lane_id, switch_thread_cond_t *cond) {
+    switch_status_t status = SWITCH_STATUS_SUCCESS;
+    sched_lane_t *lane = &globals.sched_lanes[lane_id];
+    sched_waiter_t waiter = { 0 }, **pp = NULL;
+    switch_time_t deadline = 0, now = 0;
+
+    if(!globals.sched_max_requests) {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    waiter.cond = cond;
+
+    switch_mutex_lock(globals.sched_mutex);
+
+    /* an idle lane doesn't accumulate credit */
+    if(!lane->head && lane->vtime < globals.sched_vtime) {
+        lane->vtime = globals.sched_vtime;
+    }
+    if(lane->tail) { lane->tail->next = &waiter; } else { lane->head = &waiter; }
+    lane->tail = &waiter;
+
+    sched_dispatch();
+
+    deadline = (lane->queue_timeout ? switch_micro_time_now() + (lane->queue_timeout * 1000000LL) : 0);
+    while(!waiter.fl_granted) {
+        if(!deadline) {
+            switch_thread_cond_wait(cond, globals.sched_mutex);
+            continue;
+        }
+        now = switch_micro_time_now();
+        if(now >= deadline) {
+            lane->tail = NULL;
+            for(pp = &lane->head; *pp; pp = &(*pp)->next) {
+                if(*pp == &waiter) { *pp = waiter.next; }
+                if(!*pp) { break; }
+                lane->tail = *pp;
+            }
+            status = SWITCH_STATUS_TIMEOUT;
+            break;
+        }
+        switch_thread_cond_timedwait(cond, globals.sched_mutex, (deadline - now));
+    }
+
+    switch_mutex_unlock(globals.sched_mutex);
+    return status;
+}
+
+static void sched_release(sched_lane_e lane_id) {
+    if(!globals.sched_max_requests) {
+        return;
+    }
+
+    switch_mutex_lock(globals.sched_mutex);
+    globals.sched_lanes[lane_id].running--;
+    globals.sched_running--;
+    sched_dispatch();
+    switch_mutex_unlock(globals.sched_mutex);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------------------------------
+// cache pre-warm
+// ---------------------------------------------------------------------------------------------------------------------------------------------
+static int cache_stat_rec_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const cache_stat_rec_t *)a)->hits;
+    uint32_t hb = ((const cache_stat_rec_t *)b)->hits;
+    return (ha < hb) ? 1 : (ha > hb) ? -1 : 0;
+}
+
+static int cache_stat_hits_cmp(const void *a, const void *b) {
+    uint32_t ha = *(const uint32_t *)a;
+    uint32_t hb = *(const uint32_t *)b;
+    return (ha < hb) ? -1 : (ha > hb) ? 1 : 0;
+}
+
+static switch_bool_t cache_stats_gc_callback(const void *key, const void *val, void *pdata) {
+    cache_stat_t *stat = (cache_stat_t *)val;
+    cache_stats_gc_t *gc = (cache_stats_gc_t *)pdata;
+
+    if(stat->pcm) {
+        return SWITCH_FALSE;
+    }
+    if(stat->hits > 0) {
+        if(!gc->quota || stat->hits > gc->threshold) {
+            return SWITCH_FALSE;
+        }
+        gc->quota--;
+    }
+
+    free(stat);
+    globals.cache_stats_size--;
+    return SWITCH_TRUE;
+}
+
+/*
+ * called by the pre-warm thread: halves the counters every prewarm-decay-interval (so prompts which
+ * stopped being played age out) and drops the zeroed ones and the coldest ones over prewarm-stats-max.
+ * decoded entries are kept.
+ */
+static void cache_stats_maintain(uint8_t fl_decay) {
+    switch_hash_index_t *hi = NULL;
+    cache_stats_gc_t gc = { 0 };
+    uint32_t *hits = NULL;
+    uint32_t hsize = 0, limit = 0;
+    void *val = NULL;
+
+    switch_mutex_lock(globals.mutex);
+
+    if(fl_decay) {
+        for(hi = switch_core_hash_first(globals.cache_stats); hi; hi = switch_core_hash_next(&hi)) {
+            switch_core_hash_this(hi, NULL, NULL, &val);
+            ((cache_stat_t *)val)->hits /= 2;
+        }
+        globals.fl_cache_stats_dirty = SWITCH_TRUE;
+    }
+
+    /* leave some room for the new keys till the next round */
+    limit = globals.prewarm_stats_max - (globals.prewarm_stats_max / 10);
+    if(globals.cache_stats_size > limit && (hits = malloc(sizeof(uint32_t) * globals.cache_stats_size)) != NULL) {
+        for(hi = switch_core_hash_first(globals.cache_stats); hi && hsize < globals.cache_stats_size; hi = switch_core_hash_next(&hi)) {
+            switch_core_hash_this(hi, NULL, NULL, &val);
+            if(!((cache_stat_t *)val)->pcm) {
+                hits[hsize++] = ((cache_stat_t *)val)->hits;
+            }
+        }
+        switch_safe_free(hi);
+
+        if(hsize > 0) {
+            qsort(hits, hsize, sizeof(uint32_t), cache_stat_hits_cmp);
+            gc.quota = (globals.cache_stats_size - limit) < hsize ? (globals.cache_stats_size - limit) : hsize;
+            gc.threshold = hits[gc.quota - 1];
+        }
+        switch_safe_free(hits);
+    }
+
+    if(fl_decay || gc.quota > 0) {
+        switch_core_hash_delete_multi(globals.cache_stats, cache_stats_gc_callback, &gc);
+        globals.fl_cache_stats_dirty = SWITCH_TRUE;
+    }
+
+    switch_mutex_unlock(globals.mutex);
+}
+
+static pcm_entry_t *cache_stats_touch(const char *name, uint32_t hits) {
+    cache_stat_t *stat = NULL;
+    pcm_entry_t *pcm = NULL;
+
+    switch_mutex_lock(globals.mutex);
+    if((stat = switch_core_hash_find(globals.cache_stats, name)) == NULL) {
+        if(globals.cache_stats_size < globals.prewarm_stats_max) {
+            if((stat = malloc(sizeof(cache_stat_t))) != NULL) {
+                memset(stat, 0, sizeof(cache_stat_t));
+                switch_core_hash_insert(globals.cache_stats, name, stat);
+                globals.cache_stats_size++;
+            }
+        }
+    }
+    if(stat) {
+        stat->hits += hits;
+        pcm = stat->pcm;
+        globals.fl_cache_stats_dirty = SWITCH_TRUE;
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    return pcm;
+}
+
+static void cache_stats_save() {
+    switch_memory_pool_t *pool = NULL;
+    switch_hash_index_t *hi = NULL;
+    cache_stat_rec_t *recs = NULL;
+    FILE *fp = NULL;
+    char *tmp_name = NULL;
+    const void *key = NULL;
+    void *val = NULL;
+    uint32_t i = 0, rsize = 0;
+    int fl_error = 0;
+
+    if(switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "switch_core_new_memory_pool()\n");
+        return;
+    }
+
+    /* take a snapshot and do the file i/o unlocked, the live requests use the same mutex */
+    switch_mutex_lock(globals.mutex);
+    if(globals.fl_cache_stats_dirty && globals.cache_stats_size > 0) {
+        recs = switch_core_alloc(pool, sizeof(cache_stat_rec_t) * globals.cache_stats_size);
+        for(hi = switch_core_hash_first(globals.cache_stats); hi && rsize < globals.cache_stats_size; hi = switch_core_hash_next(&hi)) {
+            switch_core_hash_this(hi, &key, NULL, &val);
+            recs[rsize].name = switch_core_strdup(pool, (char *)key);
+            recs[rsize].hits = ((cache_stat_t *)val)->hits;
+            rsize++;
+        }
+        switch_safe_free(hi);
+        globals.fl_cache_stats_dirty = SWITCH_FALSE;
+    }
+    switch_mutex_unlock(globals.mutex);
+
+    if(!recs) {
+        goto out;
+    }
+
+    tmp_name = switch_core_sprintf(pool, "%s.tmp", globals.prewarm_log);
+    if((fp = fopen(tmp_name, "w")) == NULL) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to create file (%s)\n", tmp_name);
+        goto fail;
+    }
+    for(i = 0; i < rsize; i++) {
+        fprintf(fp, "%u %s\n", recs[i].hits, recs[i].name);
+    }
+    fl_error = ferror(fp);
+    if(fclose(fp) != 0 || fl_error) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to write into file (%s)\n", tmp_name);
+        unlink(tmp_name);
+        goto fail;
+    }
+
+    if(rename(tmp_name, globals.prewarm_log) != 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to rename file (%s)\n", tmp_name);
+        unlink(tmp_name);
+        goto fail;
+    }
+    goto out;
+fail:
+    switch_mutex_lock(globals.mutex);
+    globals.fl_cache_stats_dirty = SWITCH_TRUE;
+    switch_mutex_unlock(globals.mutex);
+out:
+    switch_core_destroy_memory_pool(&pool);
+}
+
+static void cache_stats_destroy() {
+    switch_hash_index_t *hi = NULL;
+    cache_stat_t *stat = NULL;
+    void *val = NULL;
+
+    for(hi = switch_core_hash_first(globals.cache_stats); hi; hi = switch_core_hash_next(&hi)) {
+        switch_core_hash_this(hi, NULL, NULL, &val);
+        stat = (cache_stat_t *)val;
+        if(stat->pcm) {
+            switch_safe_free(stat->pcm->data);
+            switch_safe_free(stat->pcm);
+        }
+        switch_safe_free(stat);
+    }
+    switch_core_hash_destroy(&globals.cache_stats);
+}
+
+/*
+ * reads the access log left by the previous run and merges it into the live stats.
+ * returns records sorted by hits.
+ */
+static uint32_t cache_stats_load(cache_stat_rec_t **recs, switch_memory_pool_t *pool) {
+    cache_stat_rec_t *lrecs = NULL;
+    uint32_t lsize = 0, hits = 0;
+    char line[512], name[256];
+    FILE *fp = NULL;
+
+    if((fp = fopen(globals.prewarm_log, "r")) == NULL) {
+        return 0;
+    }
+
+    lrecs = switch_core_alloc(pool, sizeof(cache_stat_rec_t) * globals.prewarm_stats_max);
+
+    while(lsize < globals.prewarm_stats_max && fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, "%u %255s", &hits, name) != 2 || strchr(name, '/') || strchr(name, '\\')) {
+            continue;
+        }
+        if(hits == 0) {
+            continue;
+        }
+        cache_stats_touch(name, hits);
+
+        lrecs[lsize].name = switch_core_strdup(pool, name);
+        lrecs[lsize].hits = hits;
+        lsize++;
+    }
+    fclose(fp);
+
+    qsort(lrecs, lsize, sizeof(cache_stat_rec_t), cache_stat_rec_cmp);
+
+    *recs = lrecs;
+    return lsize;
+}
+
+static void file_readahead(const char *path) {
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#endif
+}
+
+static pcm_entry_t *file_decode(const char *path, uint32_t samplerate, uint32_t size_max) {
+    switch_file_handle_t fhnd = { 0 };
+    switch_buffer_t *buffer = NULL;
+    pcm_entry_t *pcm = NULL;
+    int16_t frame[1024];
+    size_t len = 0;
+
+    if(switch_core_file_open(&fhnd, path, 1, samplerate, (SWITCH_FILE_FLAG_READ | SWITCH_FILE_DATA_SHORT), NULL) != SWITCH_STATUS_SUCCESS) {
+        return NULL;
+    }
+
+    if(switch_buffer_create_dynamic(&buffer, 8192, 65536, size_max) != SWITCH_STATUS_SUCCESS) {
+        goto out;
+    }
+
+    while(!globals.fl_shutdown) {
+        len = (sizeof(frame) / sizeof(int16_t));
+        if(switch_core_file_read(&fhnd, frame, &len) != SWITCH_STATUS_SUCCESS || len == 0) {
+            break;
+        }
+        if(switch_buffer_write(buffer, frame, len * sizeof(int16_t)) != len * sizeof(int16_t)) {
+            goto out;
+        }
+    }
+    if(globals.fl_shutdown || (len = switch_buffer_inuse(buffer)) == 0) {
+        goto out;
+    }
+
+    if((pcm = malloc(sizeof(pcm_entry_t))) == NULL || (pcm->data = malloc(len)) == NULL) {
+        switch_safe_free(pcm);
+        goto out;
+    }
+    pcm->samples = switch_buffer_read(buffer, pcm->data, len) / sizeof(int16_t);
+    pcm->samplerate = samplerate;
+out:
+    if(buffer) {
+        switch_buffer_destroy(&buffer);
+    }
+    switch_core_file_close(&fhnd);
+    return pcm;
+}
+
+static void prewarm_flush_tick(prewarm_timer_t *timer) {
+    switch_time_t now = switch_epoch_time_now(NULL);
+    uint8_t fl_decay = SWITCH_FALSE;
+
+    if(now >= timer->next_flush) {
+        if(now >= timer->next_decay) {
+            timer->next_decay = now + globals.prewarm_decay_interval;
+            fl_decay = SWITCH_TRUE;
+        }
+        cache_stats_maintain(fl_decay);
+        cache_stats_save();
+        timer->next_flush = now + globals.prewarm_flush_interval;
+    }
+}
+
+/* the file format module can be loaded after us, give it a chance */
+static int prewarm_wait_decoder(prewarm_timer_t *timer) {
+    switch_file_interface_t *file_interface = NULL;
+    uint32_t tries = 0;
+
+    while(!globals.fl_shutdown) {
+        if((file_interface = switch_loadable_module_get_file_interface(globals.file_ext, NULL)) != NULL) {
+            UNPROTECT_INTERFACE(file_interface);
+            return SWITCH_TRUE;
+        }
+        if(++tries >= PREWARM_DECODER_WAIT) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No file format module for (%s), pre-decoding skipped\n", globals.file_ext);
+            break;
+        }
+        prewarm_flush_tick(timer);
+        switch_yield(1000000);
+    }
+
+    return SWITCH_FALSE;
+}
+
+static void *SWITCH_THREAD_FUNC prewarm_thread(switch_thread_t *thread, void *obj) {
+    switch_memory_pool_t *pool = NULL;
+    cache_stat_rec_t *recs = NULL;
+    cache_stat_t *stat = NULL;
+    pcm_entry_t *pcm = NULL;
+    char *path = NULL;
+    prewarm_timer_t timer = { 0 };
+    uint32_t i = 0, rsize = 0, decoded = 0, mem_used = 0, ndecode = 0, len = 0;
+
+    if(switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "switch_core_new_memory_pool()\n");
+        return NULL;
+    }
+
+    timer.next_flush = switch_epoch_time_now(NULL) + globals.prewarm_flush_interval;
+    timer.next_decay = switch_epoch_time_now(NULL) + globals.prewarm_decay_interval;
+
+    rsize = cache_stats_load(&recs, pool);
+    ndecode = (rsize > globals.prewarm_items ? globals.prewarm_items : rsize);
+
+    for(i = ndecode; i < rsize && !globals.fl_shutdown; i++) {
+        path = switch_core_sprintf(pool, "%s%s%s", globals.cache_path, SWITCH_PATH_SEPARATOR, recs[i].name);
+        file_readahead(path);
+    }
+
+    if(ndecode > 0 && !prewarm_wait_decoder(&timer)) {
+        for(i = 0; i < ndecode && !globals.fl_shutdown; i++) {
+            path = switch_core_sprintf(pool, "%s%s%s", globals.cache_path, SWITCH_PATH_SEPARATOR, recs[i].name);
+            file_readahead(path);
+        }
+        ndecode = 0;
+    }
+
+    for(i = 0; i < ndecode && !globals.fl_shutdown; i++) {
+        if(mem_used >= globals.prewarm_mem_max) {
+            break;
+        }
+        prewarm_flush_tick(&timer);
+
+        path = switch_core_sprintf(pool, "%s%s%s", globals.cache_path, SWITCH_PATH_SEPARATOR, recs[i].name);
+        if(switch_file_exists(path, pool) != SWITCH_STATUS_SUCCESS) {
+            continue;
+        }
+        if((pcm = file_decode(path, globals.prewarm_samplerate, globals.prewarm_mem_max - mem_used)) == NULL) {
+            file_readahead(path);
+            continue;
+        }
+
+        len = (uint32_t)(pcm->samples * sizeof(int16_t));
+
+        switch_mutex_lock(globals.mutex);
+        if((stat = switch_core_hash_find(globals.cache_stats, recs[i].name)) != NULL && stat->pcm == NULL) {
+            stat->pcm = pcm;
+            pcm = NULL;
+        }
+        switch_mutex_unlock(globals.mutex);
+
+        if(pcm) {
+            switch_safe_free(pcm->data);
+            switch_safe_free(pcm);
+            continue;
+        }
+
+        decoded++;
+        mem_used += len;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "Cache pre-warm done (records: %u, decoded: %u, memory: %u bytes)\n", rsize, decoded, mem_used);
+    switch_core_destroy_memory_pool(&pool);
+
+    while(!globals.fl_shutdown) {
+        prewarm_flush_tick(&timer);
+        switch_yield(1000000);
+    }
+
+    return NULL;
+}
+
 // ---------------------------------------------------------------------------------------------------------------------------------------------
 // speech api
 // ---------------------------------------------------------------------------------------------------------------------------------------------
@@ -266,6 +798,12 @@ static switch_status_t speech_open(switch_speech_handle_t *sh, const char *voice
     tts_ctx->channels = channels;
     tts_ctx->samplerate = samplerate;
     tts_ctx->fl_cache_enabled = globals.fl_cache_enabled;
+    tts_ctx->sched_lane = globals.sched_default_lane;
+
+    if(globals.sched_max_requests && (status = switch_thread_cond_create(&tts_ctx->sched_cond, tts_ctx->pool)) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "switch_thread_cond_create()\n");
+        goto out;
+    }
 
     sh->private_info = tts_ctx;
 
@@ -303,13 +841,28 @@ static switch_status_t speech_feed_tts(switch_speech_handle_t *sh, char *text, s
     char digest[SWITCH_MD5_DIGEST_STRING_SIZE + 1] = { 0 };
     char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1] = { 0 };
     const void *ptr = NULL;
+    char *name = NULL;
+    pcm_entry_t *pcm = NULL;
     uint32_t recv_len = 0;
 
     assert(tts_ctx != NULL);
 
+    tts_ctx->pcm = NULL;
+    tts_ctx->pcm_pos = 0;
+
     if(tts_ctx->fl_cache_enabled) {
         switch_md5_string(digest, (void *)text, strlen(text));
         tts_ctx->dst_file = switch_core_sprintf(sh->memory_pool, "%s%s%s.%s", globals.cache_path, SWITCH_PATH_SEPARATOR, digest, globals.file_ext);
+
+        if(globals.fl_prewarm_enabled) {
+            name = switch_core_sprintf(sh->memory_pool, "%s.%s", digest, globals.file_ext);
+            pcm = cache_stats_touch(name, 1);
+
+            if(pcm && pcm->samplerate == tts_ctx->samplerate && tts_ctx->channels == 1) {
+                tts_ctx->pcm = pcm;
+                goto out;
+            }
+        }
     } else {
         switch_uuid_str((char *)uuid, sizeof(uuid));
         tts_ctx->dst_file = switch_core_sprintf(sh->memory_pool, "%s%s%s.%s", globals.tmp_path, SWITCH_PATH_SEPARATOR, uuid, globals.file_ext);
@@ -325,8 +878,14 @@ static switch_status_t speech_feed_tts(switch_speech_handle_t *sh, char *text, s
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "language=[%s]\n", tts_ctx->lang_code);
 #endif
 
+    if((status = sched_acquire(tts_ctx->sched_lane, tts_ctx->sched_cond)) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Request queue timeout (lane: %s)\n", (tts_ctx->sched_lane == SCHED_LANE_BULK ? "bulk" : "interactive"));
+        goto out;
+    }
+
     switch_buffer_zero(tts_ctx->curl_recv_buffer);
     status = curl_perform(tts_ctx , text);
+    sched_release(tts_ctx->sched_lane);
     recv_len = switch_buffer_peek_zerocopy(tts_ctx->curl_recv_buffer, &ptr);
 
     if(status == SWITCH_STATUS_SUCCESS) {
@@ -355,6 +914,19 @@ static switch_status_t speech_read_tts(switch_speech_handle_t *sh, void *data, s
 
     assert(tts_ctx != NULL);
 
+    if(tts_ctx->pcm) {
+        size_t avail = (tts_ctx->pcm->samples - tts_ctx->pcm_pos);
+        len = (len > avail ? avail : len);
+        if(!len) {
+            tts_ctx->pcm = NULL;
+            return SWITCH_STATUS_FALSE;
+        }
+        memcpy(data, tts_ctx->pcm->data + tts_ctx->pcm_pos, len * sizeof(int16_t));
+        tts_ctx->pcm_pos += len;
+        *data_len = (len * sizeof(int16_t));
+        return SWITCH_STATUS_SUCCESS;
+    }
+
     if(tts_ctx->fhnd->file_interface == NULL) {
         return SWITCH_STATUS_FALSE;
     }
@@ -378,6 +950,8 @@ static void speech_flush_tts(switch_speech_handle_t *sh) {
 
     assert(tts_ctx != NULL);
 
+    tts_ctx->pcm = NULL;
+
     if(tts_ctx->fhnd != NULL && tts_ctx->fhnd->file_interface != NULL) {
         switch_core_file_close(tts_ctx->fhnd);
     }
@@ -396,6 +970,15 @@ static void speech_text_param_tts(switch_speech_handle_t *sh, char *param, const
         if(val) tts_ctx->gender = switch_core_strdup(sh->memory_pool, fmt_gender(val));
     } else if(strcasecmp(param, "cache") == 0) {
         if(val) tts_ctx->fl_cache_enabled = switch_true(val);
+    } else if(strcasecmp(param, "priority") == 0) {
+        if(val) {
+            int lane = fmt_priority(val);
+            if(lane >= 0) {
+                tts_ctx->sched_lane = lane;
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unsupported priority [%s]\n", val);
+            }
+        }
     } else {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unsupported parameter [%s]\n", param);
     }
@@ -417,6 +1000,12 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_google_tts_load) {
 
     memset(&globals, 0, sizeof(globals));
 
+    switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, pool);
+    switch_mutex_init(&globals.sched_mutex, SWITCH_MUTEX_NESTED, pool);
+
+    globals.sched_lanes[SCHED_LANE_INTERACTIVE].queue_timeout = 10;
+    globals.sched_lanes[SCHED_LANE_BULK].queue_timeout = 0;
+
     if((xml = switch_xml_open_cfg(MOD_CONFIG_NAME, &cfg, NULL)) == NULL) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to open configuration: %s\n", MOD_CONFIG_NAME);
         switch_goto_status(SWITCH_STATUS_GENERR, out);
@@ -455,6 +1044,36 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_google_tts_load) {
                 if(val) globals.proxy = switch_core_strdup(pool, val);
             } else if(!strcasecmp(var, "proxy-credentials")) {
                 if(val) globals.proxy_credentials = switch_core_strdup(pool, val);
+            } else if(!strcasecmp(var, "sched-max-requests")) {
+                if(val) globals.sched_max_requests = atoi(val);
+            } else if(!strcasecmp(var, "sched-interactive-reserved")) {
+                if(val) globals.sched_interactive_reserved = atoi(val);
+            } else if(!strcasecmp(var, "sched-interactive-weight")) {
+                if(val) globals.sched_lanes[SCHED_LANE_INTERACTIVE].weight = atoi(val);
+            } else if(!strcasecmp(var, "sched-bulk-weight")) {
+                if(val) globals.sched_lanes[SCHED_LANE_BULK].weight = atoi(val);
+            } else if(!strcasecmp(var, "sched-interactive-queue-timeout")) {
+                if(val) globals.sched_lanes[SCHED_LANE_INTERACTIVE].queue_timeout = atoi(val);
+            } else if(!strcasecmp(var, "sched-bulk-queue-timeout")) {
+                if(val) globals.sched_lanes[SCHED_LANE_BULK].queue_timeout = atoi(val);
+            } else if(!strcasecmp(var, "default-priority")) {
+                if(val && (globals.sched_default_lane = fmt_priority(val)) < 0) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unsupported default-priority [%s], using interactive\n", val);
+                }
+            } else if(!strcasecmp(var, "prewarm-enable")) {
+                if(val) globals.fl_prewarm_enabled = switch_true(val);
+            } else if(!strcasecmp(var, "prewarm-items")) {
+                if(val) globals.prewarm_items = atoi(val);
+            } else if(!strcasecmp(var, "prewarm-samplerate")) {
+                if(val) globals.prewarm_samplerate = atoi(val);
+            } else if(!strcasecmp(var, "prewarm-mem-max")) {
+                if(val) globals.prewarm_mem_max = atoi(val);
+            } else if(!strcasecmp(var, "prewarm-stats-max")) {
+                if(val) globals.prewarm_stats_max = atoi(val);
+            } else if(!strcasecmp(var, "prewarm-flush-interval")) {
+                if(val) globals.prewarm_flush_interval = atoi(val);
+            } else if(!strcasecmp(var, "prewarm-decay-interval")) {
+                if(val) globals.prewarm_decay_interval = atoi(val);
             }
         }
     }
@@ -470,6 +1089,20 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_google_tts_load) {
     globals.opt_encoding = fmt_encode(globals.opt_encoding == NULL ? "mp3" : globals.opt_encoding);
     globals.file_size_max = globals.file_size_max > 0 ? globals.file_size_max : FILE_SIZE_MAX;
     globals.file_ext = fmt_enct2fext(globals.opt_encoding);
+    globals.sched_default_lane = (globals.sched_default_lane >= 0 ? globals.sched_default_lane : SCHED_LANE_INTERACTIVE);
+    globals.sched_lanes[SCHED_LANE_INTERACTIVE].weight = globals.sched_lanes[SCHED_LANE_INTERACTIVE].weight > 0 ? globals.sched_lanes[SCHED_LANE_INTERACTIVE].weight : 8;
+    globals.sched_lanes[SCHED_LANE_BULK].weight = globals.sched_lanes[SCHED_LANE_BULK].weight > 0 ? globals.sched_lanes[SCHED_LANE_BULK].weight : 1;
+    if(globals.sched_max_requests > 0 && globals.sched_interactive_reserved >= globals.sched_max_requests) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "sched-interactive-reserved should be less than sched-max-requests\n");
+        globals.sched_interactive_reserved = (globals.sched_max_requests - 1);
+    }
+    globals.fl_prewarm_enabled = (globals.fl_prewarm_enabled && globals.fl_cache_enabled);
+    globals.prewarm_items = globals.prewarm_items > 0 ? globals.prewarm_items : 50;
+    globals.prewarm_samplerate = globals.prewarm_samplerate > 0 ? globals.prewarm_samplerate : 8000;
+    globals.prewarm_mem_max = globals.prewarm_mem_max > 0 ? globals.prewarm_mem_max : (32*1024*1024);
+    globals.prewarm_stats_max = globals.prewarm_stats_max > 0 ? globals.prewarm_stats_max : 10000;
+    globals.prewarm_flush_interval = globals.prewarm_flush_interval > 0 ? globals.prewarm_flush_interval : 60;
+    globals.prewarm_decay_interval = globals.prewarm_decay_interval > 0 ? globals.prewarm_decay_interval : 3600;
 
     if(switch_directory_exists(globals.cache_path, NULL) != SWITCH_STATUS_SUCCESS) {
         switch_dir_make(globals.cache_path, SWITCH_FPROT_OS_DEFAULT, NULL);
@@ -489,6 +1122,20 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_google_tts_load) {
     speech_interface->speech_numeric_param_tts = speech_numeric_param_tts;
     speech_interface->speech_float_param_tts = speech_float_param_tts;
 
+    if(globals.fl_prewarm_enabled) {
+        switch_threadattr_t *attr = NULL;
+
+        globals.prewarm_log = switch_core_sprintf(pool, "%s%s%s", globals.cache_path, SWITCH_PATH_SEPARATOR, PREWARM_LOG_NAME);
+        switch_core_hash_init(&globals.cache_stats);
+
+        switch_threadattr_create(&attr, pool);
+        switch_threadattr_stacksize_set(attr, SWITCH_THREAD_STACKSIZE);
+        if(switch_thread_create(&globals.prewarm_thread, attr, prewarm_thread, NULL, pool) != SWITCH_STATUS_SUCCESS) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to start pre-warm thread\n");
+            globals.prewarm_thread = NULL;
+        }
+    }
+
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "GoogleTTS (%s)\n", MOD_VERSION);
 out:
     if(xml) {
@@ -498,6 +1145,18 @@ out:
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_google_tts_shutdown) {
+    switch_status_t st = SWITCH_STATUS_SUCCESS;
+
+    globals.fl_shutdown = SWITCH_TRUE;
+
+    if(globals.prewarm_thread) {
+        switch_thread_join(&st, globals.prewarm_thread);
+    }
+
+    if(globals.cache_stats) {
+        cache_stats_save();
+        cache_stats_destroy();
+    }
 
     return SWITCH_STATUS_SUCCESS;
 }
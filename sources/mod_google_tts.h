@@ -29,9 +29,59 @@
 #define MOD_CONFIG_NAME     "google_tts.conf"
 #define FILE_SIZE_MAX       (2*1024*1024)
 #define BASE64_DEC_SZ(n)    ((n*3)/4)
+#define PREWARM_LOG_NAME    "prewarm.log"
+#define PREWARM_DECODER_WAIT 30
+#define SCHED_VTIME_SCALE   1000000
 
 //#define MOD_GTTS_DEBUG
 
+typedef enum {
+    SCHED_LANE_INTERACTIVE = 0,
+    SCHED_LANE_BULK,
+    SCHED_LANES_MAX
+} sched_lane_e;
+
+typedef struct sched_waiter_s {
+    struct sched_waiter_s   *next;
+    switch_thread_cond_t    *cond;
+    uint8_t                 fl_granted;
+} sched_waiter_t;
+
+typedef struct {
+    sched_waiter_t          *head;
+    sched_waiter_t          *tail;
+    uint64_t                vtime;
+    uint32_t                weight;
+    uint32_t                running;
+    uint32_t                queue_timeout;          // seconds, 0 - no limit
+} sched_lane_t;
+
+typedef struct {
+    int16_t                 *data;
+    size_t                  samples;
+    uint32_t                samplerate;
+} pcm_entry_t;
+
+typedef struct {
+    uint32_t                hits;
+    pcm_entry_t             *pcm;
+} cache_stat_t;
+
+typedef struct {
+    char                    *name;
+    uint32_t                hits;
+} cache_stat_rec_t;
+
+typedef struct {
+    uint32_t                threshold;
+    uint32_t                quota;
+} cache_stats_gc_t;
+
+typedef struct {
+    switch_time_t           next_flush;
+    switch_time_t           next_decay;
+} prewarm_timer_t;
+
 typedef struct {
     switch_memory_pool_t    *pool;
     switch_file_handle_t    *fhnd;
@@ -42,6 +92,10 @@ typedef struct {
     char                    *voice_name;
     char                    *dst_file;
     char                    *api_key;
+    switch_thread_cond_t    *sched_cond;
+    pcm_entry_t             *pcm;
+    size_t                  pcm_pos;
+    sched_lane_e            sched_lane;
     uint32_t                samplerate;
     uint32_t                channels;
     size_t                  curl_send_buffer_len;
@@ -54,6 +108,7 @@ char *lang2bcp47(const char *lng);
 char *fmt_enct2fext(const char *fmt);
 char *fmt_gender(const char *gender);
 char *fmt_encode(const char *fmt);
+int fmt_priority(const char *priority);
 
 char *strnstr(const char *s, const char *find, size_t slen);
 char *escape_squotes(const char *string);
@@ -44,6 +44,12 @@ char *fmt_encode(const char *fmt) {
     return (char *)fmt;
 }
 
+int fmt_priority(const char *priority) {
+    if(strcasecmp(priority, "interactive") == 0) { return SCHED_LANE_INTERACTIVE; }
+    if(strcasecmp(priority, "bulk") == 0)        { return SCHED_LANE_BULK; }
+    return -1;
+}
+
 char *fmt_enct2fext(const char *fmt) {
     if(strcasecmp(fmt, "mp3") == 0)      { return "mp3"; }
     if(strcasecmp(fmt, "linear16") == 0) { return "wav"; }